@@ -12,26 +12,44 @@
 #ifndef _XOPEN_SOURCE
 # define _XOPEN_SOURCE 600
 #endif
+// glibc hides MAP_ANON & co. once _XOPEN_SOURCE is set, and
+// sched_setaffinity(2) is a GNU extension
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <ctype.h>
 
 #include <unistd.h>
 #include <getopt.h>
 #include <errno.h>
 #include <signal.h>
+#include <sched.h>
 #include <err.h>
+#include <time.h>
+#include <poll.h>
 
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#ifdef __linux__
+# include <sys/syscall.h>
+#endif
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 // don't bother with POST requests bigger than 1MB
@@ -72,6 +90,93 @@
 # define MAX_BACKLOG 10
 #endif
 
+// number of access log records that can be queued up before the
+// logger process drains them; when full, records are dropped
+// (and counted) rather than holding up the request
+#ifndef ACCESS_LOG_RING_SIZE
+# define ACCESS_LOG_RING_SIZE 256
+#endif
+
+// how long the logger process naps when it finds the ring empty,
+// in milliseconds
+#ifndef ACCESS_LOG_FLUSH_MS
+# define ACCESS_LOG_FLUSH_MS 200
+#endif
+
+// paths longer than this are truncated in the access log
+#define ACCESS_LOG_PATH_MAX 256
+
+// how long the logger keeps going after SIGTERM, in seconds; long enough
+// for the requests still in flight to finish
+#if HANDLER_TIMEOUT_LIMIT > 0
+# define LOGGER_GRACE (HANDLER_TIMEOUT_LIMIT + 1)
+#else
+# define LOGGER_GRACE (TIMEOUT_LIMIT + 1)
+#endif
+
+// how many distinct GET/HEAD requests can be coalesced at the same time
+// (see -s); more than that just run side by side as usual
+#ifndef SINGLEFLIGHT_SLOTS
+# define SINGLEFLIGHT_SLOTS 8
+#endif
+
+// biggest response which can be shared with the requests waiting on it;
+// if the handler writes more than this, they run it themselves
+#ifndef SINGLEFLIGHT_BUFFER_SIZE
+# define SINGLEFLIGHT_BUFFER_SIZE (256 * 1024)
+#endif
+
+// how often a coalesced request checks if the response is ready,
+// in milliseconds
+#ifndef SINGLEFLIGHT_POLL_MS
+# define SINGLEFLIGHT_POLL_MS 5
+#endif
+
+// control requests (see -c) arriving within this many milliseconds
+// of each other are merged into one handler run
+#ifndef COALESCE_WINDOW_MS
+# define COALESCE_WINDOW_MS 150
+#endif
+
+// how long a -c handler run is waited on before the next one for the
+// same route goes ahead anyway, in seconds
+#if HANDLER_TIMEOUT_LIMIT > 0
+# define COALESCE_RUN_LIMIT (HANDLER_TIMEOUT_LIMIT + 1)
+#else
+# define COALESCE_RUN_LIMIT (TIMEOUT_LIMIT + 1)
+#endif
+
+#ifdef __linux__
+// see ioprio_set(2); glibc has no wrapper
+# define IOPRIO_CLASS_SHIFT 13
+# define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+# define IOPRIO_WHO_PROCESS 1
+enum {
+    IOPRIO_CLASS_NONE = 0,
+    IOPRIO_CLASS_RT,
+    IOPRIO_CLASS_BE,
+    IOPRIO_CLASS_IDLE
+};
+#endif
+
+// first file descriptor passed on by systemd socket activation, see
+// sd_listen_fds(3); also used when re-exec'ing ourselves on SIGUSR2
+#define SD_LISTEN_FDS_START 3
+
+// with -C, handler output up to this size is buffered and sent with a
+// Content-Length; anything bigger is streamed with chunked encoding
+#ifndef CGI_BUFFER_SIZE
+# define CGI_BUFFER_SIZE (64 * 1024)
+#endif
+
+// with -C, the handler's header block must fit in this many bytes
+#define CGI_HEADER_LIMIT 8192
+
+// how many -c routes can be configured
+#define MAX_COALESCE_RULES 16
+// request bodies larger than this are never merged
+#define COALESCE_BODY_MAX 1024
+
 // server socket; needs to be closed by child processes, or self on exit
 int gsock = 0;
 
@@ -89,6 +194,48 @@ int verbose = 1;
 char* payloadPath = NULL;
 // what's my pid again? avoid calling getpid() too much
 pid_t myPid = -1;
+// handlers print CGI style headers and a body, and we frame the response;
+// otherwise, they write out the whole response themselves
+int cgiMode = 0;
+// write an access log (JSON lines) to this file; "-" is stdout;
+// NULL means no access log
+char* accessLogPath = NULL;
+// pid of the access log writer process
+pid_t loggerPid = -1;
+// GET/HEAD requests whose path starts with one of these are coalesced
+// with identical concurrent requests (single-flight)
+char** singleflightPrefixes = NULL;
+size_t nSingleflightPrefixes = 0;
+// how requests to a -c route get merged
+enum coalesce_mode {
+    COALESCE_SUM,       // add up a numeric form field, e.g. relative seeks
+    COALESCE_LAST       // last one wins, e.g. absolute volume
+};
+struct coalesce_rule {
+    char* path;
+    enum coalesce_mode mode;
+    // form field to add up for COALESCE_SUM
+    char* field;
+};
+struct coalesce_rule coalesceRules[MAX_COALESCE_RULES];
+size_t nCoalesceRules = 0;
+// handler scheduling and limits, applied right before exec; keeps
+// handlers from starving mpv
+// nice level; see -n
+int handlerNice = 0;
+int handlerNiceSet = 0;
+// ioprio_set(2) value; -1 means leave it alone; see -i
+int handlerIoprio = -1;
+#ifdef __linux__
+// CPUs handlers may run on; see -a
+cpu_set_t handlerCpus;
+int handlerCpusSet = 0;
+#endif
+// RLIMIT_AS and RLIMIT_CPU; 0 means leave it alone; see -m and -t
+rlim_t handlerMaxMemory = 0;
+rlim_t handlerMaxCpu = 0;
+// cgroup.procs file of the cgroup handlers get moved into; see -g
+char* handlerCgroupProcs = NULL;
 
 // used by parser
 static const char* KNOWN_METHODS[] = {
@@ -131,6 +278,13 @@ struct parser {
     char* headers;
     // Pointer to body (raw)
     char* body;
+    // what parse() overwrote with the NUL after the body; it may be the
+    // start of a pipelined request
+    char afterBody;
+    // request line said HTTP/1.0
+    int http10;
+    // client sent Connection: close
+    int close;
 };
 
 enum parse_return {
@@ -222,6 +376,7 @@ int parse(struct parser* parser, char* buf, size_t sbuf)
                     && strncmp(p3, "HTTP/1.0", 8) != 0) {
                 return ERROR;
             }
+            parser->http10 = strncmp(p3, "HTTP/1.0", 8) == 0;
 
             parser->ip = (p1 - buf) + 1;
             // headers start at parser->ip
@@ -292,6 +447,11 @@ int parse(struct parser* parser, char* buf, size_t sbuf)
                         return ERROR;
                     }
                     parser->contentLength = CHUNKED_MAGIC;
+                } else if(strncmp(p1, "connection", strlen("connection")) == 0) {
+                    // only needed to know if we may keep the connection open
+                    for(char* pp = p3; *pp; ++pp) {
+                        if(strncasecmp(pp, "close", 5) == 0) parser->close = 1;
+                    }
                 }
 
                 // undo nullifications to allow someone else to read this garbage
@@ -355,6 +515,7 @@ undop2:
                     parser->body = buf + parser->ip;
                     // body[contentLength] should not be out of bounds, we should have
                     // overallocated by a byte for this purpose specifically
+                    parser->afterBody = parser->body[parser->contentLength];
                     parser->body[parser->contentLength] = '\0';
                     return DONE;
                 }
@@ -364,275 +525,1918 @@ undop2:
     return ERROR;
 }
 
-// in-process, quick response function for clients, in case parsing failed
+// one access log entry; fixed size, so it can live in shared memory
+// and be filled in by whichever child handled the request
+struct access_record {
+    // ring bookkeeping; see access_log_commit() and drain_access_log()
+    uint64_t seq;
+    // wall clock time when the connection was accepted, usec since epoch
+    int64_t start;
+    // phase durations, usec: reading & parsing the request, running
+    // the handler (or sending our own reply), and overall
+    int64_t parseTime;
+    int64_t handlerTime;
+    int64_t totalTime;
+    // bytes sent back to the client
+    uint64_t bytes;
+    // response status code; 0 if the response never made it out
+    int status;
+    // child which handled the request
+    pid_t pid;
+    // ipv4 of the client
+    struct in_addr client;
+    char method[8];
+    char path[ACCESS_LOG_PATH_MAX];
+};
+
+// multi producer, single consumer ring of access records.
 //
-// called in child process
-void send_message(int conn, int code, const char* msg)
-{
-    char buf[1024];
-    sprintf(buf, "HTTP/1.1 %d\r\nContent-Type: text/plain\r\nContent-Length: %zd\r\n\r\n%s\r\n",
-            code, strlen(msg) + /*len(CRLF)*/2, msg);
+// Each slot's seq says whose turn it is: a producer may claim slot
+// head % SIZE only if its seq == head, the logger may read slot
+// tail % SIZE only once its seq == tail + 1. See Vyukov's bounded queue.
+struct access_ring {
+    uint64_t head;
+    uint64_t tail;
+    // records thrown away because the ring was full
+    uint64_t dropped;
+    struct access_record slots[ACCESS_LOG_RING_SIZE];
+};
 
-    int n = 0;
+// shared with all children, mmap'd before the first fork(); NULL if -l
+// was not specified
+struct access_ring* accessRing = NULL;
 
-    // try to talk back for 3s, then give up
-    while(n++ < 3) {
-        int hr = send(conn, buf, strlen(buf), MSG_DONTWAIT);
-        if(hr == -1) {
-            if(errno == EAGAIN || errno == EWOULDBLOCK) {
-                sleep(1);
-                continue;
-            }
-            err(EXIT_FAILURE, "send");
-        }
-        break;
-    }
+// the request currently being handled by this child
+struct access_record currentRecord;
+// CLOCK_MONOTONIC timestamps of the current request phases, usec
+int64_t acceptedAt, parsedAt;
 
-    close(conn);
-    exit(0);
+int64_t monotonic_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-void send_error(int conn)
+int64_t realtime_usec(void)
 {
-    if(verbose) fprintf(stderr, "%jd: rejected\n", (intmax_t)myPid);
-    send_message(conn, 500, "Error");
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-void send_bad_request(int conn, const char* msg)
+// called in parent, before accepting anything
+void setup_access_log(void)
 {
-    if(verbose) fprintf(stderr, "%jd: rejected\n", (intmax_t)myPid);
-    send_message(conn, 400, msg);
+    accessRing = mmap(NULL, sizeof(struct access_ring),
+            PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+    if(accessRing == MAP_FAILED)
+        err(EXIT_FAILURE, "mmap(access log)");
+    memset(accessRing, 0, sizeof(struct access_ring));
+    for(uint64_t i = 0; i < ACCESS_LOG_RING_SIZE; ++i) {
+        accessRing->slots[i].seq = i;
+    }
 }
 
-void send_done(int conn)
+// fill in the method and path of the current request
+//
+// called in child process
+void access_log_request(const char* method, const char* path)
 {
-    send_message(conn, 200, "OK");
+    snprintf(currentRecord.method, sizeof(currentRecord.method), "%s", method ? method : "");
+    snprintf(currentRecord.path, sizeof(currentRecord.path), "%s", path ? path : "");
 }
 
-
-// runs in child only
-// passes off the request to the handler script
-//
-// if -0 was specified, the handler will get the request body on stdin;
-// otherwise, it's in an env var; the latter is leaner, but you only get
-// some amount of KBs available for one request
+// append the current request to the ring; never blocks, drops the
+// record if the logger fell behind
 //
 // called in child process
-void execute(int conn, struct parser* parser)
+void access_log_commit(int status, uint64_t bytes, int64_t handlerStart)
 {
-    // before closing conn...
-    // ...check if we need to pass a body, and how
-    if(parser->body) {
-        if(!payloadPath) {
-            // by env var, close stdin
-            setenv("REQBODY", parser->body, 1);
-            close(STDIN_FILENO);
+    if(!accessRing) return;
+
+    int64_t now = monotonic_usec();
+    currentRecord.status = status;
+    currentRecord.bytes = bytes;
+    currentRecord.pid = myPid;
+    if(!parsedAt) parsedAt = now;
+    if(!handlerStart) handlerStart = parsedAt;
+    currentRecord.parseTime = parsedAt - acceptedAt;
+    currentRecord.handlerTime = now - handlerStart;
+    currentRecord.totalTime = now - acceptedAt;
+
+    // dying half way through would leave a slot claimed forever,
+    // so keep the timeout from firing while we hold one
+    sigset_t alrm, old;
+    sigemptyset(&alrm);
+    sigaddset(&alrm, SIGALRM);
+    sigprocmask(SIG_BLOCK, &alrm, &old);
+
+    struct access_record* slot = NULL;
+    uint64_t pos = __atomic_load_n(&accessRing->head, __ATOMIC_RELAXED);
+    while(1) {
+        slot = &accessRing->slots[pos % ACCESS_LOG_RING_SIZE];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - pos);
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&accessRing->head, &pos, pos + 1,
+                        0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+            // pos was updated with the current head, try again
+        } else if(diff < 0) {
+            // full
+            __atomic_add_fetch(&accessRing->dropped, 1, __ATOMIC_RELAXED);
+            slot = NULL;
+            break;
         } else {
-            // set up temp buffer
-            int fd = mkstemp(payloadPath);
-            if(fd == -1) {
-                fprintf(stderr, "%jd: Failed to open %s, reason: %s\n",
-                        (intmax_t)myPid, payloadPath, strerror(errno));
-                send_error(conn); // exits
-            }
-            unlink(payloadPath);
-
-            // fill up buffer
-            size_t written = 0;
-            // will break on:
-            // - error
-            // - written == parser->contentLength
-            while(1) {
-                ssize_t wrote = write(fd, parser->body + written, parser->contentLength - written);
-                if(verbose >= 2) fprintf(stderr, "%jd: write() = %zd\n", (intmax_t)myPid, wrote);
-                if(wrote == -1) {
-                    if(errno == EAGAIN) {
-                        errno = 0;
-                        continue;
-                    }
-                    fprintf(stderr, "%jd: Failed to write to %s, reason: %s\n",
-                            (intmax_t)myPid, payloadPath, strerror(errno));
-                    send_error(conn);
-                } else if(wrote == 0) {
-                    fprintf(stderr, "%jd: failed to write to %s, reason: gave up\n",
-                            (intmax_t)myPid, payloadPath);
-                    send_error(conn); // exits
-                }
-                written += wrote;
-                if(written == parser->contentLength) break;
-            }
-
-            // "pass" buffer to child process as its stdin
-            lseek(fd, 0, SEEK_SET);
-            dup2(fd, STDIN_FILENO);
-            close(fd);
+            pos = __atomic_load_n(&accessRing->head, __ATOMIC_RELAXED);
         }
-    } else {
-        // no body, close stdin
-        close(STDIN_FILENO);
     }
 
-    // make the socket be the process's stdout
-    dup2(conn, STDOUT_FILENO);
-    // get rid of our copy
-    close(conn);
+    if(slot) {
+        currentRecord.seq = slot->seq;
+        memcpy(slot, &currentRecord, sizeof(struct access_record));
+        __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    }
 
-    // set headers env vars
-    setenv("REQHEADERS", parser->headers, 1);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
 
-    if(verbose) fprintf(stderr, "%jd: Executing %s %s\n", (intmax_t)myPid, parser->method, parser->path);
-    // exec to the handler script
-    int hr = execlp(handler, handler, parser->method, parser->path, NULL);
-    if(hr == -1)
-        err(EXIT_FAILURE, "execlp");
+// prints s as a JSON string
+void json_string(FILE* f, const char* s)
+{
+    fputc('"', f);
+    for(; *s; ++s) {
+        unsigned char c = *s;
+        if(c == '"' || c == '\\') {
+            fputc('\\', f);
+            fputc(c, f);
+        } else if(c < 0x20 || c == 0x7f) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
 }
 
-/*
-   // leaving this around in case I want to log children exiting
-void sigchld(int _ignored)
+// writes out whatever is in the ring as JSON lines; returns how many
+// records were consumed. f may be NULL, in which case they're discarded
+//
+// called in logger process
+size_t drain_access_log(FILE* f)
 {
-    (void)_ignored;
-    int wstatus;
-    pid_t pid;
-    while((pid = waitpid(-1, &wstatus, WNOHANG)) > 0)
-        ;
+    size_t n = 0;
+    while(1) {
+        uint64_t pos = accessRing->tail;
+        struct access_record* slot = &accessRing->slots[pos % ACCESS_LOG_RING_SIZE];
+        if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) break;
+
+        struct access_record r;
+        memcpy(&r, slot, sizeof(struct access_record));
+        __atomic_store_n(&slot->seq, pos + ACCESS_LOG_RING_SIZE, __ATOMIC_RELEASE);
+        accessRing->tail = pos + 1;
+        ++n;
+        if(!f) continue;
+        // the producer filled the strings with snprintf, but be paranoid
+        r.method[sizeof(r.method) - 1] = '\0';
+        r.path[sizeof(r.path) - 1] = '\0';
+
+        time_t secs = r.start / 1000000;
+        struct tm tm;
+        char when[32];
+        gmtime_r(&secs, &tm);
+        strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+
+        fprintf(f, "{\"time\":\"%s.%06jdZ\",\"pid\":%jd,\"client\":\"%s\",\"method\":",
+                when, (intmax_t)(r.start % 1000000), (intmax_t)r.pid, inet_ntoa(r.client));
+        json_string(f, r.method);
+        fprintf(f, ",\"path\":");
+        json_string(f, r.path);
+        fprintf(f, ",\"status\":%d,\"bytes\":%ju,\"parse_us\":%jd,\"handler_us\":%jd,\"total_us\":%jd}\n",
+                r.status, (uintmax_t)r.bytes,
+                (intmax_t)r.parseTime, (intmax_t)r.handlerTime, (intmax_t)r.totalTime);
+    }
+    return n;
 }
-*/
 
-void sighandler(int _ignored)
+// set from signal handlers in the logger process
+volatile sig_atomic_t loggerReopen = 0;
+volatile sig_atomic_t loggerStop = 0;
+
+void logger_sighup(int _ignored)
 {
     (void)_ignored;
-    exit(0);
+    loggerReopen = 1;
 }
 
-void handler_timedout(int _ignored)
+void logger_sigterm(int _ignored)
 {
     (void)_ignored;
-    //                      0  1  2  3  4  5  6  7  8  9 10 11 12 13  14   15
-    static char buf[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, ':', ' ' };
-    if(verbose) {
-        int pid = myPid;
-        int p = 14 /* pos of ':' */;
-        // p will point to a string containing "<pid>: ", where <pid> is myPid stringified;
-        // this does not allocate new memory, since signal handler
-        while(pid > 0) {
-            buf[--p] = pid % 10 + '0';
-            pid /= 10;
-        }
-        // we're supposed to exit asap, so ignore rval of write
-        int _ignore;
-        _ignore = write(fileno(stderr), &buf[p], 16 - p);
-        (void) _ignore;
-        _ignore = write(fileno(stderr), "timed out\n", strlen("timed out\n"));
-        (void) _ignore;
-        // I really don't understand why they need to insist so much on the return value
-        // of write; this is literally the process's last dying breath, it's really not
-        // the time to deal with bureaucracy. I hope the compiler doesn't learn to interpret
-        // the above lines as "discarding the value" or I'm going to disable that
-        // warning entirely, and then it helps noone.
+    loggerStop = 1;
+}
+
+
+FILE* open_access_log(void)
+{
+    if(strcmp(accessLogPath, "-") == 0) return stdout;
+    FILE* f = fopen(accessLogPath, "a");
+    if(!f) {
+        fprintf(stderr, "%jd: Failed to open %s, reason: %s\n",
+                (intmax_t)myPid, accessLogPath, strerror(errno));
     }
-    _exit(1);
+    return f;
 }
 
-// handle connection
-// spawns child process to do the actual handling
+// the access log writer; the only consumer of accessRing.
 //
-// called in parent and child processes, parent returns early after setting up child
-void handle(int conn, struct in_addr client_addr)
+// Reopens the file on SIGHUP (for logrotate & co.). Exits once the
+// server is gone, after writing out what's left in the ring, or
+// LOGGER_GRACE seconds after SIGTERM, which the server sends to its
+// predecessor's logger after an upgrade.
+//
+// called in logger process
+void logger_main(pid_t server)
 {
-    pid_t newpid = fork();
-    if(-1 == newpid) {
-        close(conn);
-        fprintf(stderr, "Failed to fork: %d (%s)", errno, strerror(errno));
-        errno = 0;
-        return;
-    }
+    myPid = getpid();
+    close(gsock);
+    gsock = 0;
+    close(STDIN_FILENO);
 
-    if(newpid > 0) {
-        // parent
-        close(conn);
-        return;
-    } else {
-        // child; save own pid to not call getpid() too much
-        myPid = newpid;
-    }
-    // runs in child which:
-    // - execs bash
-    // - exits
-    // so no need to worry about free
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(struct sigaction));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = logger_sighup;
+    sigaction(SIGHUP, &sa, NULL);
+    sa.sa_handler = logger_sigterm;
+    sigaction(SIGTERM, &sa, NULL);
+    // ^C on the terminal reaches the whole process group; let the
+    // server go first, and notice that it's gone
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+
+    FILE* f = open_access_log();
+    uint64_t dropped = 0;
+    int64_t stopAt = 0;
 
-    if(verbose) fprintf(stderr, "%jd: Handling request from %s\n", (intmax_t)myPid, inet_ntoa(client_addr));
+    while(1) {
+        if(loggerReopen) {
+            loggerReopen = 0;
+            if(f && f != stdout) fclose(f);
+            f = open_access_log();
+            if(verbose) fprintf(stderr, "%jd: reopened %s\n", (intmax_t)myPid, accessLogPath);
+        }
 
-    // close the listen() socket, not needed here
-    close(gsock);
-    gsock = 0;
+        // once told to stop, keep draining for a while, for the children
+        // which are still busy
+        if(loggerStop && !stopAt) stopAt = monotonic_usec();
+        int done = getppid() != server
+            || (stopAt && monotonic_usec() - stopAt > (int64_t)LOGGER_GRACE * 1000000);
 
-    // set timer now to not deal with timeouts in select
-#if HANDLER_TIMEOUT_LIMIT > 0
-    // set an alarm for the handler script
-    alarm(HANDLER_TIMEOUT_LIMIT);
-    signal(SIGALRM, handler_timedout);
-#endif
+        // if the file couldn't be opened, this still keeps the ring moving
+        size_t n = drain_access_log(f);
 
-    fd_set rfds;
-    int retval;
+        uint64_t nowDropped = __atomic_load_n(&accessRing->dropped, __ATOMIC_RELAXED);
+        if(nowDropped != dropped && f) {
+            fprintf(f, "{\"dropped\":%ju}\n", (uintmax_t)(nowDropped - dropped));
+            dropped = nowDropped;
+        }
+        if(f) fflush(f);
 
-    // read up to 1k blocks, and try parsing the request as we go
+        if(done) break;
+        if(n == 0) usleep(ACCESS_LOG_FLUSH_MS * 1000);
+    }
 
-    char* buf = malloc(1025);
-    if(!buf)
-        err(EXIT_FAILURE, "malloc");
-    char* pbuf = buf;
-    ssize_t sbuf = 0;
-    buf[1024] = '\0';
+    if(f && f != stdout) fclose(f);
+    exit(0);
+}
 
-    struct parser parser;
-    memset(&parser, 0, sizeof(struct parser));
+// called in parent
+void spawn_logger(void)
+{
+    pid_t server = getpid();
+    pid_t pid = fork();
+    if(pid == -1)
+        err(EXIT_FAILURE, "fork(logger)");
+    if(pid == 0)
+        logger_main(server); // exits
+    loggerPid = pid;
+}
 
-    // will exit on:
-    // - error
-    // - exec()
-    // - SIGALRM
-    // - connection opened, but nothing written by client
-    while(1) {
-        FD_ZERO(&rfds);
-        FD_SET(conn, &rfds);
+// status lines for the responses we write ourselves, and reason phrases
+// for -C handlers which only say Status: 404; the last one is used for
+// anything not in the list
+#define STATUS(code, reason) { code, reason, "HTTP/1.1 " #code " " reason "\r\n" }
+static const struct {
+    int code;
+    const char* reason;
+    const char* line;
+} STATUS_LINES[] = {
+    STATUS(200, "OK"),
+    STATUS(201, "Created"),
+    STATUS(204, "No Content"),
+    STATUS(206, "Partial Content"),
+    STATUS(301, "Moved Permanently"),
+    STATUS(302, "Found"),
+    STATUS(303, "See Other"),
+    STATUS(304, "Not Modified"),
+    STATUS(307, "Temporary Redirect"),
+    STATUS(308, "Permanent Redirect"),
+    STATUS(400, "Bad Request"),
+    STATUS(401, "Unauthorized"),
+    STATUS(403, "Forbidden"),
+    STATUS(404, "Not Found"),
+    STATUS(405, "Method Not Allowed"),
+    STATUS(409, "Conflict"),
+    STATUS(413, "Content Too Large"),
+    STATUS(501, "Not Implemented"),
+    STATUS(502, "Bad Gateway"),
+    STATUS(503, "Service Unavailable"),
+    STATUS(504, "Gateway Timeout"),
+    STATUS(500, "Internal Server Error"),
+};
+#undef STATUS
+#define NSTATUS_LINES (sizeof(STATUS_LINES) / sizeof(STATUS_LINES[0]))
 
-        retval = select(conn+1, &rfds, NULL, NULL, NULL);
-        if(-1 == retval)
-            err(EXIT_FAILURE, "select");
-        if(0 == retval) exit(1); // client didn't want to write to us, ignore
+const char* status_line(int code)
+{
+    for(size_t i = 0; i < NSTATUS_LINES - 1; ++i) {
+        if(STATUS_LINES[i].code == code) return STATUS_LINES[i].line;
+    }
+    return STATUS_LINES[NSTATUS_LINES - 1].line;
+}
 
-        ssize_t bytes = recv(conn, pbuf, 1024, 0);
-        if(bytes == -1) {
-            if(errno == EAGAIN) continue;
-            err(EXIT_FAILURE, "recv");
-        }
-        if(bytes > 0) {
-            sbuf += bytes;
-            pbuf[bytes] = '\0';
-        }
-        if(verbose >= 2)
-            fprintf(stderr, "%jd: DEBUG: bytes %zd buf %s pbuf %s pbuf-buf %zd\n", (intmax_t)myPid, bytes, buf, pbuf, pbuf - buf);
+// status code out of a response's status line, 0 if it doesn't look like one
+int response_status(const char* response, size_t size)
+{
+    char head[16];
+    int status = 0;
+    if(size > sizeof(head) - 1) size = sizeof(head) - 1;
+    memcpy(head, response, size);
+    head[size] = '\0';
+    if(sscanf(head, "HTTP/%*d.%*d %d", &status) != 1) return 0;
+    return status;
+}
 
-        int what = parse(&parser, buf, sbuf);
-        if(what == MORE) {
-            if(bytes == 0) {
-                // EOF
-                send_bad_request(conn, "Expected more data");
-            }
-            if(sbuf + 1025 > REQUEST_SIZE_LIMIT) {
-                // too big
-                send_bad_request(conn, "Request too large");
-            }
+// "" if we don't know it; that's allowed
+const char* reason_phrase(int code)
+{
+    for(size_t i = 0; i < NSTATUS_LINES; ++i) {
+        if(STATUS_LINES[i].code == code) return STATUS_LINES[i].reason;
+    }
+    return "";
+}
+
+// set when the relay's deadline passed; makes the writer give up
+volatile sig_atomic_t relayTimedOut = 0;
+
+// holds back partial segments while on, so that a status line and a body
+// written separately go out together; turning it off flushes them
+void cork(int conn, int on)
+{
+#if defined(TCP_CORK)
+    setsockopt(conn, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#elif defined(TCP_NOPUSH)
+    setsockopt(conn, IPPROTO_TCP, TCP_NOPUSH, &on, sizeof(on));
+#else
+    (void)conn;
+    (void)on;
+#endif
+}
+
+// writes out all of iov with as few syscalls as it can. When the
+// socket buffer is full, waits for the client to make room, but for no
+// longer than TIMEOUT_LIMIT at a time.
+//
+// returns how much was written, or -1 if the client went away or stalled
+//
+// called in child process
+ssize_t send_iov(int conn, struct iovec* iov, int niov)
+{
+    ssize_t total = 0;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    // skip empty ones, sendmsg(2) doesn't like being asked for nothing
+    while(niov > 0 && iov->iov_len == 0) { ++iov; --niov; }
+
+    while(niov > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = niov;
+        ssize_t hr = sendmsg(conn, &msg, MSG_DONTWAIT);
+        if(hr == -1) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = { conn, POLLOUT, 0 };
+                if(poll(&pfd, 1, TIMEOUT_LIMIT * 1000) == 1) continue;
+                // a signal (i.e. timeout), or the client isn't reading
+                if(verbose >= 2) fprintf(stderr, "%jd: gave up writing\n", (intmax_t)myPid);
+                return -1;
+            }
+            if(errno == EINTR && !relayTimedOut) continue;
+            return -1;
+        }
+        total += hr;
+        // drop whatever made it out
+        while(niov > 0 && (size_t)hr >= iov->iov_len) {
+            hr -= iov->iov_len;
+            ++iov;
+            --niov;
+        }
+        if(niov > 0) {
+            iov->iov_base = (char*)iov->iov_base + hr;
+            iov->iov_len -= hr;
+        }
+    }
+    return total;
+}
+
+// writes out all of buf; 0 on success, -1 if the client went away
+//
+// called in child process
+int send_all(int conn, const char* buf, size_t sbuf)
+{
+    struct iovec iov = { (void*)buf, sbuf };
+    return send_iov(conn, &iov, 1) == -1 ? -1 : 0;
+}
+
+// writes out a complete response of our own, status line, headers and
+// body, in one go
+//
+// returns how much was written, or -1 if the client went away
+//
+// called in child process
+ssize_t send_response(int conn, int code, const char* contentType, const char* body, size_t sbody)
+{
+    char headers[256];
+    int n = 0;
+    // these don't get a body
+    if(code != 204 && code != 304) {
+        n = snprintf(headers, sizeof(headers), "Content-Type: %s\r\nContent-Length: %zu\r\n",
+                contentType, sbody);
+    } else {
+        sbody = 0;
+    }
+    n += snprintf(headers + n, sizeof(headers) - n, "Connection: close\r\n\r\n");
+
+    const char* status = status_line(code);
+    struct iovec iov[3] = {
+        { (void*)status, strlen(status) },
+        { headers, n },
+        { (void*)body, sbody }
+    };
+    return send_iov(conn, iov, 3);
+}
+
+// in-process, quick response function for clients, in case parsing failed
+//
+// called in child process
+void send_message(int conn, int code, const char* msg)
+{
+    char body[512];
+    int n = snprintf(body, sizeof(body), "%s\r\n", msg);
+    if(n < 0 || (size_t)n >= sizeof(body)) n = 0;
+
+    ssize_t sent = send_response(conn, code, "text/plain", body, n);
+
+    access_log_commit(code, sent > 0 ? sent : 0, 0);
+    close(conn);
+    exit(0);
+}
+
+void send_error(int conn)
+{
+    if(verbose) fprintf(stderr, "%jd: rejected\n", (intmax_t)myPid);
+    send_message(conn, 500, "Error");
+}
+
+void send_bad_request(int conn, const char* msg)
+{
+    if(verbose) fprintf(stderr, "%jd: rejected\n", (intmax_t)myPid);
+    send_message(conn, 400, msg);
+}
+
+// the response is out; closes the connection and exits, unless the
+// client may send another request on it
+//
+// called in child process
+void done_with(int conn, int keepAlive)
+{
+    if(keepAlive) return;
+    close(conn);
+    exit(0);
+}
+
+// may the connection be reused after a properly framed response?
+int may_keep_alive(struct parser* parser)
+{
+    return cgiMode && !parser->http10 && !parser->close;
+}
+
+// appends an IMF-fixdate Date header to buf
+int date_header(char* buf, size_t sbuf)
+{
+    time_t now = time(NULL);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    return strftime(buf, sbuf, "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+}
+
+// how a -C response's end is marked
+enum framing {
+    FRAME_LENGTH,       // Content-Length, we have the whole body
+    FRAME_CHUNKED,      // Transfer-Encoding: chunked, body is streamed
+    FRAME_CLOSE         // closing the connection, for HTTP/1.0 clients
+};
+
+// the fixed up header block of a -C handler
+struct cgi_head {
+    int status;
+    // where the body starts in the handler's output
+    size_t bodyStart;
+    // status line and headers, CRLF delimited, sans the final CRLF
+    size_t size;
+    char buf[CGI_HEADER_LIMIT + 512];
+};
+
+// does the header name at p, of length l, match name?
+int header_is(const char* p, size_t l, const char* name)
+{
+    return l == strlen(name) && strncasecmp(p, name, l) == 0;
+}
+
+// RFC 9110 token characters, which header names are made of
+int is_tchar(char c)
+{
+    return isalnum((unsigned char)c) || (c && strchr("!#$%&'*+-.^_`|~", c));
+}
+
+// how much snprintf() actually put into a buffer of size sbuf, given
+// what it returned
+size_t printed(int n, size_t sbuf)
+{
+    if(n < 0 || sbuf == 0) return 0;
+    if((size_t)n >= sbuf) return sbuf - 1;
+    return n;
+}
+
+// parses and validates the header block at the start of a -C handler's
+// output: Name: value lines, LF or CRLF terminated, up to an empty line.
+// Status: sets the status line, everything which has to do with framing
+// is dropped, since we take care of that. Like RFC 3875 says, there has
+// to be at least a Content-Type, Location or Status.
+//
+// returns 0 if it's fine, -1 if the handler messed up
+int parse_cgi_head(const char* out, size_t size, struct cgi_head* h)
+{
+    const char* end = out + (size < CGI_HEADER_LIMIT ? size : CGI_HEADER_LIMIT);
+    const char* p = out;
+    char reason[64] = "";
+    int haveLocation = 0, haveContentType = 0;
+    char fields[CGI_HEADER_LIMIT];
+    size_t sfields = 0;
+
+    h->status = 0;
+    while(1) {
+        const char* eol = memchr(p, '\n', end - p);
+        // no empty line where we expected one
+        if(!eol) return -1;
+        const char* le = eol;
+        if(le > p && le[-1] == '\r') --le;
+        if(le == p) {
+            h->bodyStart = eol + 1 - out;
+            break;
+        }
+
+        const char* colon = p;
+        while(colon < le && is_tchar(*colon)) ++colon;
+        if(colon == p || colon >= le || *colon != ':') return -1;
+        const char* v = colon + 1;
+        while(v < le && (*v == ' ' || *v == '\t')) ++v;
+        const char* ve = le;
+        while(ve > v && (ve[-1] == ' ' || ve[-1] == '\t')) --ve;
+        for(const char* c = v; c < ve; ++c) {
+            if(((unsigned char)*c < 0x20 && *c != '\t') || *c == 0x7f) return -1;
+        }
+        size_t nl = colon - p;
+
+        if(header_is(p, nl, "status")) {
+            char value[80];
+            size_t sv = ve - v;
+            if(sv >= sizeof(value)) return -1;
+            memcpy(value, v, sv);
+            value[sv] = '\0';
+            int n = 0;
+            if(sscanf(value, "%3d%n", &h->status, &n) != 1 || n != 3) return -1;
+            if(h->status < 200 || h->status > 599) return -1;
+            while(value[n] == ' ') ++n;
+            snprintf(reason, sizeof(reason), "%s", value + n);
+        } else if(header_is(p, nl, "content-length")
+                || header_is(p, nl, "transfer-encoding")
+                || header_is(p, nl, "connection")
+                || header_is(p, nl, "keep-alive")
+                || header_is(p, nl, "date")) {
+            // ours
+        } else {
+            if(header_is(p, nl, "location")) haveLocation = 1;
+            if(header_is(p, nl, "content-type")) haveContentType = 1;
+            // "a:b\n" comes out as "a: b\r\n", so this can grow past
+            // what the handler wrote; too many headers is its problem
+            size_t need = nl + 2 + (ve - v) + 2;
+            if(sfields + need >= sizeof(fields)) return -1;
+            sfields += snprintf(fields + sfields, sizeof(fields) - sfields,
+                    "%.*s: %.*s\r\n", (int)nl, p, (int)(ve - v), v);
+        }
+        p = eol + 1;
+    }
+
+    if(!h->status && !haveLocation && !haveContentType) return -1;
+    if(!h->status) h->status = haveLocation ? 302 : 200;
+
+    int n = snprintf(h->buf, sizeof(h->buf), "HTTP/1.1 %d %s\r\n%.*s",
+            h->status, reason[0] ? reason : reason_phrase(h->status),
+            (int)sfields, fields);
+    h->size = printed(n, sizeof(h->buf));
+    return 0;
+}
+
+// whether the response to this request doesn't get a body
+int bodyless(struct parser* parser, int status)
+{
+    return status == 204 || status == 304 || strcmp(parser->method, "HEAD") == 0;
+}
+
+// adds our own headers to h: Date, framing and Connection, and the final CRLF
+void finish_cgi_head(struct cgi_head* h, struct parser* parser, enum framing framing, size_t contentLength, int keepAlive)
+{
+    // buf leaves room for these past CGI_HEADER_LIMIT, but don't count on it
+    size_t left = sizeof(h->buf) - h->size;
+    size_t n = date_header(h->buf + h->size, left);
+    h->size += n;
+    left -= n;
+    if(h->status != 204 && h->status != 304) {
+        if(framing == FRAME_LENGTH) {
+            n = printed(snprintf(h->buf + h->size, left, "Content-Length: %zu\r\n", contentLength), left);
+            h->size += n;
+            left -= n;
+        } else if(framing == FRAME_CHUNKED && strcmp(parser->method, "HEAD") != 0) {
+            n = printed(snprintf(h->buf + h->size, left, "Transfer-Encoding: chunked\r\n"), left);
+            h->size += n;
+            left -= n;
+        }
+    }
+    n = printed(snprintf(h->buf + h->size, left, "Connection: %s\r\n\r\n", keepAlive ? "keep-alive" : "close"), left);
+    h->size += n;
+}
+
+// sends a -C handler's complete output as a response with a Content-Length,
+// or a 502 if the handler didn't write a proper header block. Output which
+// is already a whole HTTP response goes out as it is.
+//
+// returns the status sent; *bytes is how much was sent, *keepAlive whether
+// the connection may be reused
+//
+// called in child process
+int send_cgi_response(int conn, struct parser* parser, const char* out, size_t size, uint64_t* bytes, int* keepAlive)
+{
+    ssize_t sent;
+    *keepAlive = 0;
+    *bytes = 0;
+
+    if(size >= 5 && memcmp(out, "HTTP/", 5) == 0) {
+        if(send_all(conn, out, size) == 0) *bytes = size;
+        return response_status(out, size);
+    }
+
+    struct cgi_head h;
+    if(parse_cgi_head(out, size, &h) == -1) {
+        fprintf(stderr, "%jd: handler wrote a bad header block\n", (intmax_t)myPid);
+        static const char msg[] = "Bad handler output\r\n";
+        sent = send_response(conn, 502, "text/plain", msg, strlen(msg));
+        if(sent > 0) *bytes = sent;
+        return 502;
+    }
+
+    size_t sbody = size - h.bodyStart;
+    *keepAlive = may_keep_alive(parser);
+    finish_cgi_head(&h, parser, FRAME_LENGTH, sbody, *keepAlive);
+    struct iovec iov[2] = {
+        { h.buf, h.size },
+        { (void*)(out + h.bodyStart), bodyless(parser, h.status) ? 0 : sbody }
+    };
+    sent = send_iov(conn, iov, 2);
+    if(sent == -1) *keepAlive = 0;
+    else *bytes = sent;
+    return h.status;
+}
+
+
+// moves the current process into the -g cgroup, and applies -n, -i,
+// -a, -m and -t; failing any of these is logged, but the request goes on
+//
+// called in child process
+void apply_handler_limits(void)
+{
+    if(handlerCgroupProcs) {
+        int fd = open(handlerCgroupProcs, O_WRONLY);
+        // 0 is whoever is writing
+        if(fd == -1 || write(fd, "0", 1) != 1)
+            fprintf(stderr, "%jd: Failed to join %s, reason: %s\n",
+                    (intmax_t)myPid, handlerCgroupProcs, strerror(errno));
+        if(fd != -1) close(fd);
+    }
+#ifdef __linux__
+    if(handlerCpusSet && sched_setaffinity(0, sizeof(cpu_set_t), &handlerCpus) == -1)
+        fprintf(stderr, "%jd: sched_setaffinity: %s\n", (intmax_t)myPid, strerror(errno));
+    if(handlerIoprio != -1 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, handlerIoprio) == -1)
+        fprintf(stderr, "%jd: ioprio_set: %s\n", (intmax_t)myPid, strerror(errno));
+#endif
+    if(handlerNiceSet && setpriority(PRIO_PROCESS, 0, handlerNice) == -1)
+        fprintf(stderr, "%jd: setpriority: %s\n", (intmax_t)myPid, strerror(errno));
+
+    struct rlimit rl;
+    if(handlerMaxMemory) {
+        rl.rlim_cur = rl.rlim_max = handlerMaxMemory;
+        if(setrlimit(RLIMIT_AS, &rl) == -1)
+            fprintf(stderr, "%jd: setrlimit(RLIMIT_AS): %s\n", (intmax_t)myPid, strerror(errno));
+    }
+    if(handlerMaxCpu) {
+        rl.rlim_cur = rl.rlim_max = handlerMaxCpu;
+        if(setrlimit(RLIMIT_CPU, &rl) == -1)
+            fprintf(stderr, "%jd: setrlimit(RLIMIT_CPU): %s\n", (intmax_t)myPid, strerror(errno));
+    }
+}
+
+// exec to the handler script, with stdin and stdout already set up
+//
+// called in child process
+void exec_handler(struct parser* parser)
+{
+    apply_handler_limits();
+
+    // set headers env vars
+    setenv("REQHEADERS", parser->headers, 1);
+
+    // we ignore it, the handler shouldn't
+    signal(SIGPIPE, SIG_DFL);
+
+    if(verbose) fprintf(stderr, "%jd: Executing %s %s\n", (intmax_t)myPid, parser->method, parser->path);
+    // exec to the handler script
+    int hr = execlp(handler, handler, parser->method, parser->path, NULL);
+    if(hr == -1)
+        err(EXIT_FAILURE, "execlp");
+}
+
+// spin lock living in shared memory, for the tables shared between children.
+//
+// SIGALRM is held off while the lock is held, or a timed out child
+// could leave it locked forever
+void shm_lock(char* lock, sigset_t* old)
+{
+    sigset_t alrm;
+    sigemptyset(&alrm);
+    sigaddset(&alrm, SIGALRM);
+    sigprocmask(SIG_BLOCK, &alrm, old);
+    while(__atomic_test_and_set(lock, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+void shm_unlock(char* lock, sigset_t* old)
+{
+    __atomic_clear(lock, __ATOMIC_RELEASE);
+    sigprocmask(SIG_SETMASK, old, NULL);
+}
+
+enum flight_state {
+    FLIGHT_FREE = 0,    // never used
+    FLIGHT_RUNNING,     // the leader is running the handler
+    FLIGHT_DONE,        // response is ready
+    FLIGHT_FAILED       // response didn't fit, or the leader gave up
+};
+
+// one in-progress (or recently finished) coalesced request
+struct flight {
+    enum flight_state state;
+    // bumped every time the slot is reused, so readers can tell
+    // if the response changed under them
+    uint64_t generation;
+    // the child running the handler
+    pid_t leader;
+    // "METHOD path?query"
+    char key[ACCESS_LOG_PATH_MAX + 8];
+    size_t size;
+    char response[SINGLEFLIGHT_BUFFER_SIZE];
+};
+
+struct flight_table {
+    // guards everything but the response bytes
+    char lock;
+    struct flight slots[SINGLEFLIGHT_SLOTS];
+};
+
+// shared with all children, mmap'd before the first fork(); NULL unless
+// -s was specified
+struct flight_table* flights = NULL;
+
+// called in parent, before accepting anything
+void setup_singleflight(void)
+{
+    // MAP_ANON pages only get allocated when first written to
+    flights = mmap(NULL, sizeof(struct flight_table),
+            PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+    if(flights == MAP_FAILED)
+        err(EXIT_FAILURE, "mmap(single-flight)");
+}
+
+
+// is this a request which may be coalesced with others?
+int is_singleflight(struct parser* parser)
+{
+    if(!flights || parser->body) return 0;
+    if(strcmp(parser->method, "GET") != 0 && strcmp(parser->method, "HEAD") != 0) return 0;
+    for(size_t i = 0; i < nSingleflightPrefixes; ++i) {
+        if(strncmp(parser->path, singleflightPrefixes[i], strlen(singleflightPrefixes[i])) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// waits for someone else's response to our exact request, and sends a
+// copy of it to our client. Returns 0 if that didn't work out, in which
+// case we should run the handler ourselves. Otherwise, exits, or returns
+// 1 if the connection may be reused.
+//
+// called in child process
+int wait_for_flight(int conn, struct parser* parser, struct flight* flight, uint64_t generation)
+{
+    while(1) {
+        enum flight_state state = __atomic_load_n(&flight->state, __ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&flight->generation, __ATOMIC_ACQUIRE) != generation) return 0;
+        if(state == FLIGHT_DONE) break;
+        if(state != FLIGHT_RUNNING) return 0;
+        // leader died without telling anyone
+        if(kill(flight->leader, 0) == -1 && errno == ESRCH) return 0;
+        usleep(SINGLEFLIGHT_POLL_MS * 1000);
+    }
+
+    // copy it out, then make sure the slot wasn't reused in the meantime
+    int64_t handlerStart = monotonic_usec();
+    size_t size = flight->size;
+    char* response = malloc(size + 1);
+    if(!response)
+        err(EXIT_FAILURE, "malloc");
+    memcpy(response, flight->response, size);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&flight->generation, __ATOMIC_ACQUIRE) != generation) {
+        free(response);
+        return 0;
+    }
+
+    if(verbose) fprintf(stderr, "%jd: coalesced with %jd\n", (intmax_t)myPid, (intmax_t)flight->leader);
+    // the leader shared what the handler wrote, not what it sent
+    uint64_t bytes = 0;
+    int status = 0;
+    int keepAlive = 0;
+    if(cgiMode) {
+        status = send_cgi_response(conn, parser, response, size, &bytes, &keepAlive);
+    } else {
+        if(send_all(conn, response, size) == 0) bytes = size;
+        status = response_status(response, size);
+    }
+    free(response);
+    access_log_commit(status, bytes, handlerStart);
+    done_with(conn, keepAlive);
+    return 1;
+}
+
+// finds a request identical to ours which is already running, and waits
+// for its response; if that worked out, sets *answered (or exits, see
+// done_with()). Otherwise, returns a slot for us to share our response
+// through, or NULL if there's no room.
+//
+// called in child process
+struct flight* join_flight(int conn, struct parser* parser, int* answered)
+{
+    *answered = 0;
+    char key[sizeof(((struct flight*)0)->key)];
+    int n = snprintf(key, sizeof(key), "%s %s", parser->method, parser->path);
+    if(n < 0 || (size_t)n >= sizeof(key)) return NULL;
+
+    sigset_t old;
+    struct flight* mine = NULL;
+    struct flight* running = NULL;
+    uint64_t generation = 0;
+
+    shm_lock(&flights->lock, &old);
+    for(size_t i = 0; i < SINGLEFLIGHT_SLOTS; ++i) {
+        struct flight* f = &flights->slots[i];
+        if(f->state == FLIGHT_RUNNING && strcmp(f->key, key) == 0) {
+            running = f;
+            generation = f->generation;
+            break;
+        }
+        // prefer never used slots, then finished ones, then ones whose
+        // leader died on us
+        if(f->state == FLIGHT_FREE) {
+            if(!mine || mine->state != FLIGHT_FREE) mine = f;
+        } else if(f->state != FLIGHT_RUNNING) {
+            if(!mine || mine->state == FLIGHT_RUNNING) mine = f;
+        } else if(!mine && kill(f->leader, 0) == -1 && errno == ESRCH) {
+            mine = f;
+        }
+    }
+    if(!running && mine) {
+        mine->generation++;
+        mine->leader = myPid;
+        mine->size = 0;
+        strcpy(mine->key, key);
+        __atomic_store_n(&mine->state, FLIGHT_RUNNING, __ATOMIC_RELEASE);
+    }
+    shm_unlock(&flights->lock, &old);
+
+    if(running) {
+        *answered = wait_for_flight(conn, parser, running, generation);
+        return NULL;
+    }
+    return mine;
+}
+
+// lets everyone waiting on us know how it went
+//
+// called in child process
+void land_flight(struct flight* flight, int ok)
+{
+    sigset_t old;
+    shm_lock(&flights->lock, &old);
+    if(flight->leader == myPid && flight->state == FLIGHT_RUNNING)
+        __atomic_store_n(&flight->state, ok ? FLIGHT_DONE : FLIGHT_FAILED, __ATOMIC_RELEASE);
+    shm_unlock(&flights->lock, &old);
+}
+
+void relay_timedout(int _ignored)
+{
+    (void)_ignored;
+    relayTimedOut = 1;
+}
+
+// state shared between relay() and its helpers
+struct relay {
+    int conn;
+    // the handler's stdout
+    int fd;
+    // requests waiting on our response, if any
+    struct flight* flight;
+    // whether the response is still making it whole into flight
+    int shared;
+    // whether we read the handler's output through to the end
+    int eof;
+    int clientGone;
+    // sent to the client so far
+    uint64_t bytes;
+};
+
+// reads some of the handler's output, keeping a copy for the requests
+// waiting on us; returns 0 on EOF, -1 on error or timeout
+//
+// called in child process
+ssize_t relay_read(struct relay* r, char* buf, size_t sbuf)
+{
+    while(!relayTimedOut) {
+        ssize_t got = read(r->fd, buf, sbuf);
+        if(got == -1) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        if(got == 0) {
+            r->eof = 1;
+            return 0;
+        }
+        if(r->shared) {
+            if(r->flight->size + got > SINGLEFLIGHT_BUFFER_SIZE) {
+                // too big, the others will have to run it themselves
+                r->shared = 0;
+                land_flight(r->flight, 0);
+            } else {
+                memcpy(r->flight->response + r->flight->size, buf, got);
+                r->flight->size += got;
+            }
+        }
+        return got;
+    }
+    return -1;
+}
+
+// passes some of the response on to the client, unless it went away
+//
+// called in child process
+void relay_send(struct relay* r, struct iovec* iov, int niov)
+{
+    if(r->clientGone) return;
+    ssize_t sent = send_iov(r->conn, iov, niov);
+    if(sent == -1) r->clientGone = 1;
+    else r->bytes += sent;
+}
+
+// copies the handler's output as it is, starting with what's already
+// been read into pre; returns the status sent
+//
+// called in child process
+int relay_raw(struct relay* r, const char* pre, size_t spre)
+{
+    char buf[4096];
+    // first few bytes, for the status line
+    char head[16];
+    size_t shead = 0;
+    ssize_t got = spre;
+    const char* p = pre;
+    // nothing read yet, start with the handler's output
+    if(!pre) {
+        got = relay_read(r, buf, sizeof(buf));
+        p = buf;
+    }
+    while(got > 0) {
+        if(shead < sizeof(head)) {
+            size_t n = sizeof(head) - shead;
+            if(n > (size_t)got) n = got;
+            memcpy(head + shead, p, n);
+            shead += n;
+        }
+        struct iovec iov = { (void*)p, got };
+        relay_send(r, &iov, 1);
+        // if our client went away, keep going for the others' sake
+        if(r->clientGone && !r->shared) break;
+        got = relay_read(r, buf, sizeof(buf));
+        p = buf;
+    }
+    return r->bytes > 0 ? response_status(head, shead) : 0;
+}
+
+// -C: buffers the handler's output and sends it with a Content-Length, or
+// if there's too much of it, streams it chunked (or until we close the
+// connection, for HTTP/1.0). Returns the status sent; *keepAlive says if
+// the connection may be reused.
+//
+// called in child process
+int relay_cgi(struct relay* r, struct parser* parser, int* keepAlive)
+{
+    *keepAlive = 0;
+    char* out = malloc(CGI_BUFFER_SIZE);
+    if(!out)
+        err(EXIT_FAILURE, "malloc");
+    size_t size = 0;
+    ssize_t got = 0;
+    while(size < CGI_BUFFER_SIZE && (got = relay_read(r, out + size, CGI_BUFFER_SIZE - size)) > 0)
+        size += got;
+
+    int status;
+    if(relayTimedOut) {
+        static const char msg[] = "Handler timed out\r\n";
+        ssize_t sent = send_response(r->conn, 504, "text/plain", msg, strlen(msg));
+        if(sent > 0) r->bytes = sent;
+        status = 504;
+    } else if(r->eof || got == -1 || (size >= 5 && memcmp(out, "HTTP/", 5) == 0)) {
+        // all of it, or a whole response of its own
+        if(size >= 5 && memcmp(out, "HTTP/", 5) == 0 && !r->eof) {
+            status = relay_raw(r, out, size);
+        } else {
+            status = send_cgi_response(r->conn, parser, out, size, &r->bytes, keepAlive);
+        }
+    } else {
+        // too big to buffer, stream it
+        struct cgi_head h;
+        if(parse_cgi_head(out, size, &h) == -1) {
+            fprintf(stderr, "%jd: handler wrote a bad header block\n", (intmax_t)myPid);
+            static const char msg[] = "Bad handler output\r\n";
+            ssize_t sent = send_response(r->conn, 502, "text/plain", msg, strlen(msg));
+            if(sent > 0) r->bytes = sent;
+            free(out);
+            return 502;
+        }
+        status = h.status;
+        enum framing framing = parser->http10 ? FRAME_CLOSE : FRAME_CHUNKED;
+        int nobody = bodyless(parser, status);
+        *keepAlive = may_keep_alive(parser) && framing == FRAME_CHUNKED;
+        finish_cgi_head(&h, parser, framing, 0, *keepAlive);
+
+        const char* body = out + h.bodyStart;
+        size_t sbody = size - h.bodyStart;
+        char chunk[32];
+        while(1) {
+            struct iovec iov[4];
+            int niov = 0;
+            if(h.size) {
+                iov[niov].iov_base = h.buf;
+                iov[niov++].iov_len = h.size;
+                h.size = 0;
+            }
+            if(nobody) {
+                // and the response ends with the headers
+            } else if(framing == FRAME_CHUNKED) {
+                if(sbody) {
+                    iov[niov].iov_base = chunk;
+                    iov[niov++].iov_len = snprintf(chunk, sizeof(chunk), "%zx\r\n", sbody);
+                    iov[niov].iov_base = (void*)body;
+                    iov[niov++].iov_len = sbody;
+                    iov[niov].iov_base = "\r\n";
+                    iov[niov++].iov_len = 2;
+                } else if(r->eof) {
+                    iov[niov].iov_base = "0\r\n\r\n";
+                    iov[niov++].iov_len = 5;
+                }
+            } else {
+                iov[niov].iov_base = (void*)body;
+                iov[niov++].iov_len = sbody;
+            }
+            relay_send(r, iov, niov);
+            if(r->eof || nobody || (r->clientGone && !r->shared)) break;
+
+            got = relay_read(r, out, CGI_BUFFER_SIZE);
+            if(got == -1) break;
+            body = out;
+            sbody = got;
+        }
+        // cut short, the client can't tell where it ends
+        if(!r->eof && !nobody) *keepAlive = 0;
+    }
+
+    if(r->clientGone) *keepAlive = 0;
+    free(out);
+    return status;
+}
+
+// runs the handler in a grandchild, with its stdout on a pipe, and copies
+// whatever it writes back to the client; this way we get to see the
+// status line and how much was sent, keep a copy for the requests
+// waiting on flight, if any, and with -C, frame the response.
+//
+// exits, or returns if the connection may be reused
+//
+// called in child process
+void relay(int conn, struct parser* parser, struct flight* flight)
+{
+    int pfd[2];
+    if(pipe(pfd) == -1) {
+        fprintf(stderr, "%jd: pipe: %s\n", (intmax_t)myPid, strerror(errno));
+        send_error(conn); // exits
+    }
+
+    // alarms don't survive fork(), pass on what's left of ours
+    unsigned left = alarm(0);
+    int64_t handlerStart = monotonic_usec();
+
+    pid_t pid = fork();
+    if(pid == -1) {
+        fprintf(stderr, "%jd: Failed to fork: %s\n", (intmax_t)myPid, strerror(errno));
+        send_error(conn); // exits
+    }
+    if(pid == 0) {
+        if(left) alarm(left);
+        close(pfd[0]);
+        dup2(pfd[1], STDOUT_FILENO);
+        close(pfd[1]);
+        close(conn);
+        exec_handler(parser);
+    }
+
+    close(pfd[1]);
+
+    // on timeout, interrupt read() and send() rather than dying, so
+    // the request still gets logged
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(struct sigaction));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = relay_timedout;
+    sigaction(SIGALRM, &sa, NULL);
+    relayTimedOut = 0;
+    if(left) alarm(left);
+
+    // handlers tend to write the status line, headers and body separately;
+    // send them in full segments instead
+    cork(conn, 1);
+
+    struct relay r;
+    memset(&r, 0, sizeof(struct relay));
+    r.conn = conn;
+    r.fd = pfd[0];
+    r.flight = flight;
+    r.shared = flight != NULL;
+
+    int status;
+    int keepAlive = 0;
+    if(cgiMode) {
+        status = relay_cgi(&r, parser, &keepAlive);
+    } else {
+        status = relay_raw(&r, NULL, 0);
+    }
+
+    if(flight) land_flight(flight, r.shared && r.eof);
+    if(!r.clientGone) cork(conn, 0);
+
+    if(relayTimedOut) {
+        if(verbose) fprintf(stderr, "%jd: timed out\n", (intmax_t)myPid);
+        kill(pid, SIGKILL);
+        keepAlive = 0;
+    }
+    alarm(0);
+    close(pfd[0]);
+
+    access_log_commit(status, r.bytes, handlerStart);
+    done_with(conn, keepAlive);
+}
+
+// runs in child only
+// passes off the request to the handler script
+//
+// if -0 was specified, the handler will get the request body on stdin;
+// otherwise, it's in an env var; the latter is leaner, but you only get
+// some amount of KBs available for one request
+//
+// exits, or with -C, returns if the connection may be reused
+//
+// called in child process
+void execute(int conn, struct parser* parser)
+{
+    // identical GET/HEADs may share a response
+    struct flight* flight = NULL;
+    if(is_singleflight(parser)) {
+        int answered;
+        flight = join_flight(conn, parser, &answered); // may exit
+        if(answered) return;
+    }
+
+    // before closing conn...
+    // ...check if we need to pass a body, and how
+    if(parser->body) {
+        if(!payloadPath) {
+            // by env var, close stdin
+            setenv("REQBODY", parser->body, 1);
+            close(STDIN_FILENO);
+        } else {
+            // set up temp buffer; mkstemp() eats the template, and with -C
+            // there may be more requests on this connection
+            char tmpl[strlen(payloadPath) + 1];
+            strcpy(tmpl, payloadPath);
+            int fd = mkstemp(tmpl);
+            if(fd == -1) {
+                fprintf(stderr, "%jd: Failed to open %s, reason: %s\n",
+                        (intmax_t)myPid, tmpl, strerror(errno));
+                send_error(conn); // exits
+            }
+            unlink(tmpl);
+
+            // fill up buffer
+            size_t written = 0;
+            // will break on:
+            // - error
+            // - written == parser->contentLength
+            while(1) {
+                ssize_t wrote = write(fd, parser->body + written, parser->contentLength - written);
+                if(verbose >= 2) fprintf(stderr, "%jd: write() = %zd\n", (intmax_t)myPid, wrote);
+                if(wrote == -1) {
+                    if(errno == EAGAIN) {
+                        errno = 0;
+                        continue;
+                    }
+                    fprintf(stderr, "%jd: Failed to write to %s, reason: %s\n",
+                            (intmax_t)myPid, payloadPath, strerror(errno));
+                    send_error(conn);
+                } else if(wrote == 0) {
+                    fprintf(stderr, "%jd: failed to write to %s, reason: gave up\n",
+                            (intmax_t)myPid, payloadPath);
+                    send_error(conn); // exits
+                }
+                written += wrote;
+                if(written == parser->contentLength) break;
+            }
+
+            // "pass" buffer to child process as its stdin; if an earlier
+            // request on this connection closed stdin, it may already be
+            lseek(fd, 0, SEEK_SET);
+            if(fd != STDIN_FILENO) {
+                dup2(fd, STDIN_FILENO);
+                close(fd);
+            }
+        }
+    } else {
+        // no body, close stdin
+        close(STDIN_FILENO);
+        // in case the previous request on this connection had one
+        unsetenv("REQBODY");
+    }
+
+    // with an access log, others waiting on our response, or -C, we
+    // need to see the response go by
+    if(accessRing || flight || cgiMode) {
+        relay(conn, parser, flight); // exits, unless keeping the connection
+        return;
+    }
+
+    // same as in relay(); the kernel flushes whatever's left when the
+    // handler exits and the socket gets closed
+    cork(conn, 1);
+
+    // make the socket be the process's stdout
+    dup2(conn, STDOUT_FILENO);
+    // get rid of our copy
+    close(conn);
+
+    exec_handler(parser);
+}
+
+// a merged command waiting to be passed on to the handler; one per -c route
+struct pending_command {
+    // set while requests are being merged into this
+    int pending;
+    // bumped whenever a child becomes the one to run the handler once
+    // the window closes, so one which was given up on can tell
+    uint64_t window;
+    // when the window was opened or taken over, monotonic usec
+    int64_t openedAt;
+    // handler runs are numbered in the order their windows open; run n
+    // goes once finished == n
+    uint64_t started;
+    uint64_t finished;
+    // the current window's run
+    uint64_t ticket;
+    // how many requests got merged
+    unsigned count;
+    // COALESCE_SUM total
+    long long sum;
+    // COALESCE_LAST body
+    size_t size;
+    char body[COALESCE_BODY_MAX];
+};
+
+struct command_table {
+    char lock;
+    struct pending_command routes[MAX_COALESCE_RULES];
+};
+
+// shared with all children, mmap'd before the first fork(); NULL unless
+// -c was specified
+struct command_table* commands = NULL;
+
+// called in parent, before accepting anything
+void setup_coalescing(void)
+{
+    commands = mmap(NULL, sizeof(struct command_table),
+            PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+    if(commands == MAP_FAILED)
+        err(EXIT_FAILURE, "mmap(coalescing)");
+}
+
+// parses -c /path:sum:field or -c /path:last
+//
+// called in parent
+void add_coalesce_rule(const char* arg)
+{
+    if(nCoalesceRules >= MAX_COALESCE_RULES) {
+        fprintf(stderr, "Too many -c routes, at most %d\n", MAX_COALESCE_RULES);
+        exit(2);
+    }
+    char* spec = strdup(arg);
+    char* mode = strchr(spec, ':');
+    if(!mode || mode == spec) goto bad;
+    *mode++ = '\0';
+
+    struct coalesce_rule* rule = &coalesceRules[nCoalesceRules];
+    rule->path = spec;
+    rule->field = NULL;
+    if(strcmp(mode, "last") == 0) {
+        rule->mode = COALESCE_LAST;
+    } else if(strncmp(mode, "sum:", 4) == 0 && mode[4]) {
+        rule->mode = COALESCE_SUM;
+        rule->field = mode + 4;
+    } else {
+        goto bad;
+    }
+    ++nCoalesceRules;
+    return;
+bad:
+    fprintf(stderr, "Bad -c %s, expected /path:sum:field or /path:last\n", arg);
+    exit(2);
+}
+
+// finds an integer field in an application/x-www-form-urlencoded body
+int form_number(const char* body, const char* field, long long* value)
+{
+    size_t l = strlen(field);
+    const char* p = body;
+    while(p) {
+        if(strncmp(p, field, l) == 0 && p[l] == '=') {
+            char* end;
+            errno = 0;
+            *value = strtoll(p + l + 1, &end, 10);
+            return errno == 0 && end != p + l + 1 && (*end == '\0' || *end == '&');
+        }
+        p = strchr(p, '&');
+        if(p) ++p;
+    }
+    return 0;
+}
+
+// answers 204 right away, without exiting
+//
+// called in child process
+void reply_no_content(int conn)
+{
+    ssize_t sent = send_response(conn, 204, NULL, NULL, 0);
+    access_log_commit(204, sent > 0 ? sent : 0, 0);
+    close(conn);
+}
+
+// the first request's headers, with content-length fixed up for the
+// merged body; header names are lowercase'd by parse()
+//
+// called in child process
+char* merged_headers(const char* headers, size_t contentLength)
+{
+    size_t sheaders = strlen(headers) + 64;
+    char* merged = malloc(sheaders);
+    if(!merged)
+        err(EXIT_FAILURE, "malloc");
+    char* q = merged;
+    const char* p = headers;
+    while(*p) {
+        const char* eol = strchr(p, '\n');
+        eol = eol ? eol + 1 : p + strlen(p);
+        if(strncmp(p, "content-length:", strlen("content-length:")) != 0) {
+            memcpy(q, p, eol - p);
+            q += eol - p;
+        }
+        p = eol;
+    }
+    snprintf(q, sheaders - (q - merged), "content-length: %zu\r\n", contentLength);
+    return merged;
+}
+
+// merges the request into whatever else came in for the same route in
+// the last COALESCE_WINDOW_MS, and answers 204. The first request of the
+// window waits for it to close, then runs the handler once for all of
+// them, after the previous run for the route is done.
+//
+// returns if the request can't be merged; exits otherwise
+//
+// called in child process
+void coalesce(int conn, struct parser* parser)
+{
+    if(!commands || !parser->body || parser->contentLength >= COALESCE_BODY_MAX) return;
+
+    size_t i;
+    for(i = 0; i < nCoalesceRules; ++i) {
+        if(strcmp(parser->path, coalesceRules[i].path) == 0) break;
+    }
+    if(i == nCoalesceRules) return;
+    struct coalesce_rule* rule = &coalesceRules[i];
+    struct pending_command* cmd = &commands->routes[i];
+
+    long long value = 0;
+    if(rule->mode == COALESCE_SUM && !form_number(parser->body, rule->field, &value)) return;
+
+    // the window's flusher waits it out, then at most COALESCE_RUN_LIMIT
+    // for the previous run; if it's been longer, it died on the way
+    const int64_t stale = COALESCE_WINDOW_MS * 1000LL + (COALESCE_RUN_LIMIT + 1) * 1000000LL;
+    int64_t now = monotonic_usec();
+
+    sigset_t old;
+    int flusher = 0;
+    uint64_t window, ticket;
+    shm_lock(&commands->lock, &old);
+    if(!cmd->pending) {
+        cmd->pending = 1;
+        cmd->count = 0;
+        cmd->sum = 0;
+        cmd->ticket = cmd->started++;
+        flusher = 1;
+    } else if(now - cmd->openedAt > stale) {
+        // whoever was supposed to run it is gone, take over its turn
+        flusher = 1;
+    }
+    if(flusher) {
+        cmd->window++;
+        cmd->openedAt = now;
+    }
+    window = cmd->window;
+    ticket = cmd->ticket;
+    cmd->count++;
+    if(rule->mode == COALESCE_SUM) {
+        cmd->sum += value;
+    } else {
+        memcpy(cmd->body, parser->body, parser->contentLength);
+        cmd->size = parser->contentLength;
+    }
+    shm_unlock(&commands->lock, &old);
+
+    reply_no_content(conn);
+    if(!flusher) exit(0);
+
+    // we're on the handler's time budget from here on, not the client's
+    alarm(0);
+    usleep(COALESCE_WINDOW_MS * 1000);
+    // keep them in order, but don't wait forever on a run which never
+    // reported back
+    int64_t giveUp = monotonic_usec() + COALESCE_RUN_LIMIT * 1000000LL;
+    while(__atomic_load_n(&cmd->finished, __ATOMIC_ACQUIRE) < ticket
+            && monotonic_usec() < giveUp) {
+        usleep(SINGLEFLIGHT_POLL_MS * 1000);
+    }
+
+    static char body[COALESCE_BODY_MAX + 1];
+    unsigned count;
+    shm_lock(&commands->lock, &old);
+    if(!cmd->pending || cmd->window != window) {
+        // we took too long, someone else has it
+        shm_unlock(&commands->lock, &old);
+        exit(0);
+    }
+    cmd->pending = 0;
+    count = cmd->count;
+    if(rule->mode == COALESCE_SUM) {
+        snprintf(body, sizeof(body), "%s=%lld", rule->field, cmd->sum);
+    } else {
+        memcpy(body, cmd->body, cmd->size);
+        body[cmd->size] = '\0';
+    }
+    shm_unlock(&commands->lock, &old);
+
+    parser->body = body;
+    parser->contentLength = strlen(body);
+    char* headers = merged_headers(parser->headers, parser->contentLength);
+    free(parser->headers);
+    parser->headers = headers;
+    if(verbose) fprintf(stderr, "%jd: merged %u requests into %s\n", (intmax_t)myPid, count, body);
+
+    // run it in a child of our own, so we can tell the next run when
+    // this one's done
+    pid_t pid = fork();
+    if(pid == -1) {
+        fprintf(stderr, "%jd: Failed to fork: %s\n", (intmax_t)myPid, strerror(errno));
+    } else if(pid == 0) {
+        myPid = getpid();
+#if HANDLER_TIMEOUT_LIMIT > 0
+        alarm(HANDLER_TIMEOUT_LIMIT);
+#endif
+        // everyone's been answered already, and logged with the 204; the
+        // merged run isn't a request of its own
+        accessRing = NULL;
+        int devnull = open("/dev/null", O_WRONLY);
+        if(devnull == -1)
+            err(EXIT_FAILURE, "open(/dev/null)");
+        execute(devnull, parser);
+        exit(0);
+    } else {
+        // SIGCHLD is SA_NOCLDWAIT, so this fails with ECHILD, but only
+        // once the child is gone
+        while(waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+            ;
+    }
+
+    // the next run may go; unless it gave up on us already
+    uint64_t done = __atomic_load_n(&cmd->finished, __ATOMIC_RELAXED);
+    while(done < ticket + 1
+            && !__atomic_compare_exchange_n(&cmd->finished, &done, ticket + 1,
+                0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    exit(0);
+}
+
+/*
+   // leaving this around in case I want to log children exiting
+void sigchld(int _ignored)
+{
+    (void)_ignored;
+    int wstatus;
+    pid_t pid;
+    while((pid = waitpid(-1, &wstatus, WNOHANG)) > 0)
+        ;
+}
+*/
+
+void sighandler(int _ignored)
+{
+    (void)_ignored;
+    exit(0);
+}
+
+// set from signal handlers in the parent, handled in the accept loop
+volatile sig_atomic_t reloadRequested = 0;
+volatile sig_atomic_t upgradeRequested = 0;
+// the parent keeps SIGHUP and SIGUSR2 blocked, except while waiting for
+// a connection, so they can't slip in between checking for them and
+// blocking; this is the mask to wait with, and what children get back
+sigset_t waitMask;
+
+void sighup(int _ignored)
+{
+    (void)_ignored;
+    reloadRequested = 1;
+}
+
+void sigusr2(int _ignored)
+{
+    (void)_ignored;
+    upgradeRequested = 1;
+}
+
+// SIGHUP: the handler_script is exec'd anew for every request anyway,
+// so there's nothing to reload but the access log
+//
+// called in parent
+void reload(void)
+{
+    reloadRequested = 0;
+    if(verbose) fprintf(stderr, "Reloading\n");
+    if(0 != access(handler, R_OK|X_OK))
+        fprintf(stderr, "Warning: %s is not executable: %s\n", handler, strerror(errno));
+    if(loggerPid > 0) kill(loggerPid, SIGHUP);
+}
+
+// SIGUSR2: re-exec ourselves, e.g. after installing a new jakserver,
+// handing the listening socket over the way systemd's socket activation
+// would. Connections keep queueing up in the meantime. Requests in
+// flight carry on in their own child processes; the old logger drains
+// whatever they log, then exits.
+//
+// returns if exec failed, in which case we keep going as we were
+//
+// called in parent
+void upgrade(int* sockfd, char* argv[])
+{
+    upgradeRequested = 0;
+    if(*sockfd != SD_LISTEN_FDS_START) {
+        if(dup2(*sockfd, SD_LISTEN_FDS_START) == -1) {
+            fprintf(stderr, "Failed to upgrade: dup2: %s\n", strerror(errno));
+            return;
+        }
+        close(*sockfd);
+        *sockfd = gsock = SD_LISTEN_FDS_START;
+    }
+    fcntl(*sockfd, F_SETFD, 0);
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%jd", (intmax_t)getpid());
+    setenv("LISTEN_PID", buf, 1);
+    setenv("LISTEN_FDS", "1", 1);
+    if(loggerPid > 0) {
+        snprintf(buf, sizeof(buf), "%jd", (intmax_t)loggerPid);
+        setenv("JAKSERVER_OLD_LOGGER", buf, 1);
+    }
+
+    if(verbose) fprintf(stderr, "Upgrading, exec %s\n", argv[0]);
+    execvp(argv[0], argv);
+
+    fprintf(stderr, "Failed to upgrade: execvp(%s): %s\n", argv[0], strerror(errno));
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("JAKSERVER_OLD_LOGGER");
+    fcntl(*sockfd, F_SETFD, FD_CLOEXEC);
+}
+
+// the listening socket, if systemd (or upgrade()) passed one on;
+// -1 otherwise
+//
+// called in parent
+int inherited_socket(void)
+{
+    const char* pid = getenv("LISTEN_PID");
+    const char* fds = getenv("LISTEN_FDS");
+    if(!pid || !fds || atoi(pid) != getpid()) return -1;
+    int n = atoi(fds);
+    // not meant for the handler_script
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    if(n < 1) return -1;
+    if(n > 1) fprintf(stderr, "Got %d sockets, only listening on the first one\n", n);
+    fcntl(SD_LISTEN_FDS_START, F_SETFD, FD_CLOEXEC);
+    return SD_LISTEN_FDS_START;
+}
+
+void handler_timedout(int _ignored)
+{
+    (void)_ignored;
+    //                      0  1  2  3  4  5  6  7  8  9 10 11 12 13  14   15
+    static char buf[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, ':', ' ' };
+    if(verbose) {
+        int pid = myPid;
+        int p = 14 /* pos of ':' */;
+        // p will point to a string containing "<pid>: ", where <pid> is myPid stringified;
+        // this does not allocate new memory, since signal handler
+        while(pid > 0) {
+            buf[--p] = pid % 10 + '0';
+            pid /= 10;
+        }
+        // we're supposed to exit asap, so ignore rval of write
+        int _ignore;
+        _ignore = write(fileno(stderr), &buf[p], 16 - p);
+        (void) _ignore;
+        _ignore = write(fileno(stderr), "timed out\n", strlen("timed out\n"));
+        (void) _ignore;
+        // I really don't understand why they need to insist so much on the return value
+        // of write; this is literally the process's last dying breath, it's really not
+        // the time to deal with bureaucracy. I hope the compiler doesn't learn to interpret
+        // the above lines as "discarding the value" or I'm going to disable that
+        // warning entirely, and then it helps noone.
+    }
+    _exit(1);
+}
+
+// (re)starts the clocks for a request
+//
+// called in child process
+void start_request(void)
+{
+    // set timer now to not deal with timeouts in select
+#if HANDLER_TIMEOUT_LIMIT > 0
+    // set an alarm for the handler script
+    alarm(HANDLER_TIMEOUT_LIMIT);
+    signal(SIGALRM, handler_timedout);
+#endif
+    if(accessRing) {
+        acceptedAt = monotonic_usec();
+        currentRecord.start = realtime_usec();
+        parsedAt = 0;
+    }
+}
+
+// drops the request we just answered from buf, keeping whatever the
+// client pipelined after it; returns how much of that there is
+//
+// called in child process
+ssize_t next_request(struct parser* parser, char** buf, ssize_t sbuf)
+{
+    size_t used = parser->ip;
+    if(parser->body) {
+        parser->body[parser->contentLength] = parser->afterBody;
+        used = parser->body - *buf + parser->contentLength;
+    }
+    ssize_t left = sbuf - used;
+    memmove(*buf, *buf + used, left);
+
+    free(parser->method);
+    free(parser->path);
+    free(parser->headers);
+    memset(parser, 0, sizeof(struct parser));
+
+    *buf = realloc(*buf, left + 1025);
+    if(!*buf)
+        err(EXIT_FAILURE, "realloc");
+    (*buf)[left] = '\0';
+    return left;
+}
+
+// handle connection
+// spawns child process to do the actual handling
+//
+// called in parent and child processes, parent returns early after setting up child
+void handle(int conn, struct in_addr client_addr)
+{
+    if(accessRing) {
+        acceptedAt = monotonic_usec();
+        currentRecord.start = realtime_usec();
+        currentRecord.client = client_addr;
+    }
+
+    pid_t newpid = fork();
+    if(-1 == newpid) {
+        close(conn);
+        fprintf(stderr, "Failed to fork: %d (%s)", errno, strerror(errno));
+        errno = 0;
+        return;
+    }
+
+    if(newpid > 0) {
+        // parent
+        close(conn);
+        return;
+    } else {
+        // child; save own pid to not call getpid() too much
+        myPid = getpid();
+    }
+    // runs in child which:
+    // - execs bash
+    // - exits
+    // so no need to worry about free
+
+    if(verbose) fprintf(stderr, "%jd: Handling request from %s\n", (intmax_t)myPid, inet_ntoa(client_addr));
+
+    // close the listen() socket, not needed here
+    close(gsock);
+    gsock = 0;
+
+    // responses are written in as few writes as possible, so there's no
+    // point in Nagle holding back the last bit of them
+    int nodelay = 1;
+    setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    // those are for the parent
+    signal(SIGHUP, SIG_DFL);
+    signal(SIGUSR2, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &waitMask, NULL);
+    // a client hanging up on us is not a reason to die before logging it
+    signal(SIGPIPE, SIG_IGN);
+
+    // set timer now to not deal with timeouts in select
+#if HANDLER_TIMEOUT_LIMIT > 0
+    // set an alarm for the handler script
+    alarm(HANDLER_TIMEOUT_LIMIT);
+    signal(SIGALRM, handler_timedout);
+#endif
+
+    // with -C, the connection may carry more than one request
+    int idle = 0;
+    // and some of the next one may already be in buf
+    int pipelined = 0;
+
+    fd_set rfds;
+    int retval;
+
+    // read up to 1k blocks, and try parsing the request as we go
+
+    char* buf = malloc(1025);
+    if(!buf)
+        err(EXIT_FAILURE, "malloc");
+    char* pbuf = buf;
+    ssize_t sbuf = 0;
+    buf[1024] = '\0';
+
+    struct parser parser;
+    memset(&parser, 0, sizeof(struct parser));
+
+    // will exit on:
+    // - error
+    // - exec()
+    // - SIGALRM
+    // - connection opened, but nothing written by client
+    // - client done with a kept alive connection
+    while(1) {
+        ssize_t bytes = -1;
+        if(pipelined) {
+            // try what we have first
+            pipelined = 0;
+        } else {
+            FD_ZERO(&rfds);
+            FD_SET(conn, &rfds);
+
+            // between requests, don't wait around forever; the alarm
+            // only covers a request once it started
+            struct timeval tv = { TIMEOUT_LIMIT, 0 };
+            retval = select(conn+1, &rfds, NULL, NULL, idle ? &tv : NULL);
+            if(-1 == retval)
+                err(EXIT_FAILURE, "select");
+            if(0 == retval) exit(idle ? 0 : 1); // client didn't want to write to us, ignore
+
+            bytes = recv(conn, pbuf, 1024, 0);
+            if(bytes == -1) {
+                if(errno == EAGAIN) continue;
+                err(EXIT_FAILURE, "recv");
+            }
+            // client closed a kept alive connection
+            if(bytes == 0 && idle) exit(0);
+            if(bytes > 0) {
+                sbuf += bytes;
+                pbuf[bytes] = '\0';
+            }
+            if(idle) {
+                idle = 0;
+                start_request();
+            }
+        }
+        if(verbose >= 2)
+            fprintf(stderr, "%jd: DEBUG: bytes %zd buf %s pbuf %s pbuf-buf %zd\n", (intmax_t)myPid, bytes, buf, pbuf, pbuf - buf);
+
+        int what = parse(&parser, buf, sbuf);
+        if(accessRing && what != MORE) {
+            parsedAt = monotonic_usec();
+            access_log_request(parser.method, parser.path);
+        }
+        if(what == MORE) {
+            if(accessRing) access_log_request(parser.method, parser.path);
+            if(bytes == 0) {
+                // EOF
+                send_bad_request(conn, "Expected more data");
+            }
+            if(sbuf + 1025 > REQUEST_SIZE_LIMIT) {
+                // too big
+                send_bad_request(conn, "Request too large");
+            }
             buf = realloc(buf, sbuf + 1025);
             if(!buf)
                 err(EXIT_FAILURE, "realloc");
             pbuf = buf + sbuf;
             continue;
         } else if(what == DONE) {
-            execute(conn, &parser);
-            send_done(conn);
+            coalesce(conn, &parser); // exits if it merged the request
+            execute(conn, &parser); // exits, unless keeping the connection
+
+            // next request on this connection
+            sbuf = next_request(&parser, &buf, sbuf);
+            pbuf = buf + sbuf;
+            if(sbuf > 0) {
+                pipelined = 1;
+                start_request();
+            } else {
+                idle = 1;
+                alarm(0);
+            }
         } else if(what == NOT_IMPLEMENTED) {
             send_message(conn, 501, "Not implemented");
         } else {
@@ -641,9 +2445,138 @@ void handle(int conn, struct in_addr client_addr)
     }
 }
 
+#ifdef __linux__
+// parses a cpu list like taskset(1) -c does, e.g. 0-2,3
+void parse_cpus(const char* flag, const char* arg, cpu_set_t* cpus)
+{
+    CPU_ZERO(cpus);
+    const char* p = arg;
+    while(*p) {
+        char* end;
+        long from = strtol(p, &end, 10);
+        long to = from;
+        if(end == p) goto bad;
+        if(*end == '-') {
+            p = end + 1;
+            to = strtol(p, &end, 10);
+            if(end == p) goto bad;
+        }
+        if(from < 0 || to < from || to >= CPU_SETSIZE) goto bad;
+        for(long i = from; i <= to; ++i) CPU_SET(i, cpus);
+        if(*end == ',') ++end;
+        else if(*end) goto bad;
+        p = end;
+    }
+    if(CPU_COUNT(cpus) > 0) return;
+bad:
+    fprintf(stderr, "Bad cpu list passed to %s: %s\n", flag, arg);
+    exit(2);
+}
+
+// parses idle, be[:level] or rt[:level]
+int parse_ioprio(const char* arg)
+{
+    int level = 4;
+    const char* colon = strchr(arg, ':');
+    if(colon) {
+        char* end;
+        level = strtol(colon + 1, &end, 10);
+        if(end == colon + 1 || *end || level < 0 || level > 7) goto bad;
+    }
+    size_t l = colon ? (size_t)(colon - arg) : strlen(arg);
+    if(l == 4 && strncmp(arg, "idle", 4) == 0 && !colon)
+        return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+    if(l == 2 && strncmp(arg, "be", 2) == 0)
+        return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, level);
+    if(l == 2 && strncmp(arg, "rt", 2) == 0)
+        return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_RT, level);
+bad:
+    fprintf(stderr, "Bad -i %s, expected idle, be[:0-7] or rt[:0-7]\n", arg);
+    exit(2);
+}
+#endif
+
+// parses a plain integer in [min, max], like -n's nice level
+long parse_number(const char* flag, const char* arg, long min, long max)
+{
+    char* end;
+    errno = 0;
+    long n = strtol(arg, &end, 10);
+    if(end == arg || *end || errno || n < min || n > max) {
+        fprintf(stderr, "Bad value passed to %s: %s\n", flag, arg);
+        exit(2);
+    }
+    return n;
+}
+
+// parses a positive number with an optional k, m or g suffix
+rlim_t parse_size(const char* flag, const char* arg)
+{
+    char* end;
+    int shifts = 0;
+    // strtoull() would take -1 and wrap it around
+    if(!isdigit((unsigned char)arg[0])) goto bad;
+    errno = 0;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if(errno) goto bad;
+    switch(*end) {
+        case 'g': case 'G': ++shifts; /*fallthrough*/
+        case 'm': case 'M': ++shifts; /*fallthrough*/
+        case 'k': case 'K': ++shifts; ++end; break;
+    }
+    if(*end || n == 0) goto bad;
+    while(shifts--) {
+        if(n > RLIM_INFINITY / 1024) goto bad;
+        n *= 1024;
+    }
+    // RLIM_INFINITY means no limit at all
+    if(n >= RLIM_INFINITY) goto bad;
+    return (rlim_t)n;
+bad:
+    fprintf(stderr, "Bad value passed to %s: %s\n", flag, arg);
+    exit(2);
+}
+
+// creates the -g cgroup if needed, and sets its cpu.weight
+//
+// called in parent
+void setup_cgroup(const char* arg)
+{
+    char* dir = strdup(arg);
+    char* weight = strrchr(dir, ':');
+    if(weight) *weight++ = '\0';
+
+    if(mkdir(dir, 0755) == -1 && errno != EEXIST)
+        err(EXIT_FAILURE, "mkdir(-g cgroup)");
+
+    if(weight) {
+        char* end;
+        long w = strtol(weight, &end, 10);
+        if(end == weight || *end || w < 1 || w > 10000) {
+            fprintf(stderr, "Bad cpu.weight passed to -g: %s, expected 1-10000\n", weight);
+            exit(2);
+        }
+        size_t sz = strlen(dir) + strlen("/cpu.weight") + 1;
+        char* path = malloc(sz);
+        snprintf(path, sz, "%s/cpu.weight", dir);
+        FILE* f = fopen(path, "w");
+        if(!f || fprintf(f, "%ld\n", w) < 0 || fclose(f) != 0)
+            err(EXIT_FAILURE, "%s", path);
+        free(path);
+    }
+
+    size_t sz = strlen(dir) + strlen("/cgroup.procs") + 1;
+    handlerCgroupProcs = malloc(sz);
+    snprintf(handlerCgroupProcs, sz, "%s/cgroup.procs", dir);
+    if(0 != access(handlerCgroupProcs, W_OK))
+        err(EXIT_FAILURE, "access(%s, w)", handlerCgroupProcs);
+    free(dir);
+}
+
 void help(const char* argv0)
 {
-    printf("Usage: %s -x handler_script [-H ip4] [-p port] [-q] [-v]\n"
+    printf("Usage: %s -x handler_script [-H ip4] [-p port] [-q] [-v] [-0 /dev/shm] [-l access.log] [-s /prefix] [-c /path:mode]\n"
+            "       [-C] [-n nice] [-i class] [-a cpus] [-A cpus] [-m bytes] [-t secs] [-g cgroup]\n"
             "Version %s\n"
             "by Vlad Mesco\n\n"
             "\t-h                 print this message\n"
@@ -654,6 +2587,24 @@ void help(const char* argv0)
             "\t-x handler_script  path to an executable script to handle requests\n"
             "\t-0 /dev/shm        sends request body to handler_script via its stdin\n"
             "\t                   expects a writable path, like /dev/shm or /tmp\n"
+            "\t-l access.log      write an access log, as JSON lines; - is stdout\n"
+            "\t                   reopened on SIGHUP\n"
+            "\t-s /prefix         identical concurrent GET/HEADs under /prefix get\n"
+            "\t                   the same response, with one handler run; may be repeated\n"
+            "\t-c /path:sum:field requests to /path within a short window are answered\n"
+            "\t-c /path:last      with 204 and merged into one handler run, adding up\n"
+            "\t                   form field, or keeping the last body; may be repeated\n"
+            "\t-C                 handler_script prints CGI style headers (Status:,\n"
+            "\t                   Content-Type: ...) and a body; jakserver frames the\n"
+            "\t                   response and keeps HTTP/1.1 connections open\n"
+            "\t-n nice            nice level for handler_script, -20 to 19\n"
+            "\t-i class[:level]   I/O priority for handler_script: idle, be or rt\n"
+            "\t-a cpus            CPUs handler_script may run on, e.g. 1-3\n"
+            "\t-A cpus            CPUs the server itself may run on, e.g. 0\n"
+            "\t-m bytes           RLIMIT_AS for handler_script, e.g. 256m\n"
+            "\t-t seconds         RLIMIT_CPU for handler_script\n"
+            "\t-g cgroup[:weight] cgroup v2 directory handler_script runs in;\n"
+            "\t                   created if needed; weight sets its cpu.weight\n"
             "\n"
             "The handler_script will receive 2 or 3 arguments:\n"
             "  o the request method\n"
@@ -665,6 +2616,9 @@ void help(const char* argv0)
             "If -0 dirpath is specified, that location will be used to buffer\n"
             "request bodies. The handler_script may read the body from its stdin\n"
             "\n"
+            "SIGHUP reopens the access log. SIGUSR2 re-executes jakserver, keeping\n"
+            "the listening socket. systemd socket activation is supported.\n"
+            "\n"
             "Log is on STDERR\n"
             ,
             argv0,
@@ -675,11 +2629,25 @@ void help(const char* argv0)
             "REQUEST_SIZE_LIMIT=%d\n"
             "TIMEOUT_LIMIT=%d\n"
             "HANDLER_TIMEOUT_LIMIT=%d\n"
+            "ACCESS_LOG_RING_SIZE=%d\n"
+            "ACCESS_LOG_FLUSH_MS=%d\n"
+            "SINGLEFLIGHT_SLOTS=%d\n"
+            "SINGLEFLIGHT_BUFFER_SIZE=%d\n"
+            "SINGLEFLIGHT_POLL_MS=%d\n"
+            "COALESCE_WINDOW_MS=%d\n"
+            "CGI_BUFFER_SIZE=%d\n"
             ,
             MAX_BACKLOG,
             REQUEST_SIZE_LIMIT,
             TIMEOUT_LIMIT,
-            HANDLER_TIMEOUT_LIMIT);
+            HANDLER_TIMEOUT_LIMIT,
+            ACCESS_LOG_RING_SIZE,
+            ACCESS_LOG_FLUSH_MS,
+            SINGLEFLIGHT_SLOTS,
+            SINGLEFLIGHT_BUFFER_SIZE,
+            SINGLEFLIGHT_POLL_MS,
+            COALESCE_WINDOW_MS,
+            CGI_BUFFER_SIZE);
 
     exit(2);
 }
@@ -687,7 +2655,14 @@ void help(const char* argv0)
 int main(int argc, char* argv[])
 {
     int opt;
-    while((opt = getopt(argc, argv, "H:p:x:hqv0:")) != -1) {
+    // see -g, set up after option parsing
+    char* cgroup = NULL;
+#ifdef __linux__
+    // see -A
+    cpu_set_t serverCpus;
+    int serverCpusSet = 0;
+#endif
+    while((opt = getopt(argc, argv, "H:p:x:hqv0:l:s:c:Cn:i:a:A:m:t:g:")) != -1) {
         switch(opt) {
             case 'h': help(argv[0]); return 2;
             case 'x': free(handler); handler = strdup(optarg); break;
@@ -696,6 +2671,30 @@ int main(int argc, char* argv[])
             case 'q': verbose--; break;
             case 'v': verbose++; break;
             case '0': free(payloadPath); payloadPath = strdup(optarg); break;
+            case 'l': free(accessLogPath); accessLogPath = strdup(optarg); break;
+            case 's':
+                      singleflightPrefixes = realloc(singleflightPrefixes, (nSingleflightPrefixes + 1) * sizeof(char*));
+                      if(!singleflightPrefixes)
+                          err(EXIT_FAILURE, "realloc");
+                      singleflightPrefixes[nSingleflightPrefixes++] = strdup(optarg);
+                      break;
+            case 'c': add_coalesce_rule(optarg); break;
+            case 'C': cgiMode = 1; break;
+            case 'n': handlerNice = parse_number("-n", optarg, -20, 19); handlerNiceSet = 1; break;
+#ifdef __linux__
+            case 'i': handlerIoprio = parse_ioprio(optarg); break;
+            case 'a': parse_cpus("-a", optarg, &handlerCpus); handlerCpusSet = 1; break;
+            case 'A': parse_cpus("-A", optarg, &serverCpus); serverCpusSet = 1; break;
+#else
+            case 'i':
+            case 'a':
+            case 'A':
+                      fprintf(stderr, "-%c is only supported on Linux\n", opt);
+                      return 2;
+#endif
+            case 'm': handlerMaxMemory = parse_size("-m", optarg); break;
+            case 't': handlerMaxCpu = parse_number("-t", optarg, 1, LONG_MAX); break;
+            case 'g': free(cgroup); cgroup = strdup(optarg); break;
             default:
                       fprintf(stderr, "Unknown flag %c\n", opt);
                       help(argv[0]);
@@ -741,18 +2740,20 @@ int main(int argc, char* argv[])
 #undef TEMPLATE_TAIL
     }
 
-    myPid = getpid();
+    if(cgroup) {
+        setup_cgroup(cgroup);
+        free(cgroup);
+    }
 
-    // establish server
+#ifdef __linux__
+    // children inherit this; handlers get -a, if specified
+    if(serverCpusSet && sched_setaffinity(0, sizeof(cpu_set_t), &serverCpus) == -1)
+        err(EXIT_FAILURE, "sched_setaffinity(-A)");
+#endif
 
-    int hr = 0;
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if(-1 == sockfd)
-        err(EXIT_FAILURE, "socket");
+    myPid = getpid();
 
-    int nnn = 1;
-    if(-1 == setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &nnn, sizeof(int)))
-        err(EXIT_FAILURE, "setsockopt(SO_REUSEADDR)");
+    // establish server
 
     struct sockaddr_in sockaddr = {
 #ifdef __OpenBSD__
@@ -762,25 +2763,90 @@ int main(int argc, char* argv[])
         htons(port),
         { iface }
     };
-    hr = bind(sockfd, (struct sockaddr*)&sockaddr, sizeof(sockaddr));
-    if(-1 == hr)
-        err(EXIT_FAILURE, "bind");
 
-    hr = listen(sockfd, MAX_BACKLOG);
-    if(-1 == hr)
-        err(EXIT_FAILURE, "listen");
+    // socket activation, or upgrade() from a previous version
+    int sockfd = inherited_socket();
+    if(-1 != sockfd) {
+        socklen_t sockaddr_size = sizeof(sockaddr);
+        if(-1 == getsockname(sockfd, (struct sockaddr*)&sockaddr, &sockaddr_size))
+            err(EXIT_FAILURE, "getsockname(LISTEN_FDS)");
+        if(sockaddr.sin_family != AF_INET) {
+            fprintf(stderr, "Inherited socket is not IPv4\n");
+            exit(2);
+        }
+    } else {
+        int hr = 0;
+        sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        if(-1 == sockfd)
+            err(EXIT_FAILURE, "socket");
+
+        int nnn = 1;
+        if(-1 == setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &nnn, sizeof(int)))
+            err(EXIT_FAILURE, "setsockopt(SO_REUSEADDR)");
+
+        hr = bind(sockfd, (struct sockaddr*)&sockaddr, sizeof(sockaddr));
+        if(-1 == hr)
+            err(EXIT_FAILURE, "bind");
+
+        hr = listen(sockfd, MAX_BACKLOG);
+        if(-1 == hr)
+            err(EXIT_FAILURE, "listen");
+    }
 
     gsock = sockfd;
 
     if(verbose) {
         char* host = inet_ntoa(sockaddr.sin_addr);
-        fprintf(stderr, "Listening on %s:%u\n", host, port);
+        fprintf(stderr, "Listening on %s:%u\n", host, ntohs(sockaddr.sin_port));
     }
 
     signal(SIGINT, sighandler);
     signal(SIGQUIT, sighandler);
 
+    if(nSingleflightPrefixes > 0) {
+        setup_singleflight();
+    }
+
+    if(nCoalesceRules > 0) {
+        setup_coalescing();
+    }
+
+    if(accessLogPath) {
+        setup_access_log();
+        spawn_logger();
+    }
+
+    // we've just been upgraded; the previous logger can wind down
+    const char* oldLogger = getenv("JAKSERVER_OLD_LOGGER");
+    if(oldLogger) {
+        kill(atoi(oldLogger), SIGTERM);
+        unsetenv("JAKSERVER_OLD_LOGGER");
+    }
+
+    // SIGHUP and SIGUSR2 only get through while we wait in pselect(2)
+    sigset_t reloadSignals;
+    sigemptyset(&reloadSignals);
+    sigaddset(&reloadSignals, SIGHUP);
+    sigaddset(&reloadSignals, SIGUSR2);
+    if(sigprocmask(SIG_BLOCK, &reloadSignals, &waitMask) == -1)
+        err(EXIT_FAILURE, "sigprocmask");
+    sigdelset(&waitMask, SIGHUP);
+    sigdelset(&waitMask, SIGUSR2);
+
     struct sigaction sa;
+    memset(&sa, 0, sizeof(struct sigaction));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = sighup;
+    if(sigaction(SIGHUP, &sa, NULL) == -1)
+        err(EXIT_FAILURE, "sigaction");
+    sa.sa_handler = sigusr2;
+    if(sigaction(SIGUSR2, &sa, NULL) == -1)
+        err(EXIT_FAILURE, "sigaction");
+
+    // the connection pselect(2) saw may be gone by the time we accept(2)
+    // it; don't block there with the signals held back
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+
     memset(&sa, 0, sizeof(struct sigaction));
     //sa.sa_handler = sigchld;
     sa.sa_handler = SIG_DFL;
@@ -792,20 +2858,44 @@ int main(int argc, char* argv[])
     sa.sa_flags = SA_RESTART|SA_NOCLDWAIT;
     if(sigaction(SIGCHLD, &sa, NULL) == -1)
         err(EXIT_FAILURE, "sigaction");
+    // children of the version we were upgraded from may have exited
+    // before that took effect
+    while(waitpid(-1, NULL, WNOHANG) > 0)
+        ;
 
     // main loop
 
     // exits on signals
     while(1) {
+        if(reloadRequested) reload();
+        if(upgradeRequested) upgrade(&sockfd, argv);
+
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(sockfd, &rfds);
+        if(pselect(sockfd + 1, &rfds, NULL, NULL, NULL, &waitMask) == -1) {
+            // EINTR is SIGHUP or SIGUSR2
+            if(errno != EINTR)
+                fprintf(stderr, "Failed to wait for connections: %d (%s)\n", errno, strerror(errno));
+            errno = 0;
+            continue;
+        }
+
         struct sockaddr_in client;
         socklen_t client_size = sizeof(struct sockaddr_in);
         memset(&client, 0, sizeof(struct sockaddr_in));
         int conn = accept(sockfd, (struct sockaddr*)&client, &client_size);
         if(-1 == conn) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) {
+                errno = 0;
+                continue;
+            }
             fprintf(stderr, "Failed to accept connection: %d (%s)\n", errno, strerror(errno));
             errno = 0;
             continue;
         }
+        // some systems hand out accepted sockets non-blocking too
+        fcntl(conn, F_SETFL, fcntl(conn, F_GETFL) & ~O_NONBLOCK);
 
         handle(conn, client.sin_addr);
     }
@@ -0,0 +1,53 @@
+#!/bin/bash
+# Checks responses still make it through when jakserver has to relay them
+# (-l and -s), with and without -C. Run from the repo root after make.
+
+PORT=${PORT:-8098}
+TMP=`mktemp -d`
+trap 'kill $SERVER 2>/dev/null; rm -rf "$TMP"' EXIT
+
+cat > "$TMP/raw.sh" <<'EOF'
+#!/bin/sh
+sleep 0.3
+printf 'HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nok\n'
+EOF
+cat > "$TMP/cgi.sh" <<'EOF'
+#!/bin/sh
+sleep 0.3
+printf 'Content-Type: text/plain\n\nok\n'
+EOF
+chmod +x "$TMP/raw.sh" "$TMP/cgi.sh"
+
+FAILED=0
+
+check() {
+    handler="$1"
+    shift
+    : > "$TMP/access.log"
+    ./jakserver -p $PORT -x "$TMP/$handler" -l "$TMP/access.log" -s /slow -v "$@" 2>"$TMP/server.log" &
+    SERVER=$!
+    sleep 0.5
+
+    CURLS=()
+    for i in 1 2 3 4 ; do
+        curl -sf -m 5 localhost:$PORT/slow > "$TMP/out$i" &
+        CURLS[$i]=$!
+    done
+    for i in 1 2 3 4 ; do
+        wait ${CURLS[$i]} || { echo "FAIL $handler $*: request $i failed" ; FAILED=1 ; }
+        [ "`cat "$TMP/out$i"`" = ok ] || { echo "FAIL $handler $*: bad body for request $i" ; FAILED=1 ; }
+    done
+
+    kill $SERVER
+    wait $SERVER 2>/dev/null
+    # the logger flushes on its way out
+    sleep 0.5
+    [ `grep -c '"status":200' "$TMP/access.log"` -eq 4 ] || { echo "FAIL $handler $*: access log" ; cat "$TMP/access.log" ; FAILED=1 ; }
+    [ `grep -c coalesced "$TMP/server.log"` -ge 1 ] || { echo "FAIL $handler $*: nothing coalesced" ; FAILED=1 ; }
+}
+
+check raw.sh
+check cgi.sh -C
+
+[ $FAILED = 0 ] && echo OK
+exit $FAILED